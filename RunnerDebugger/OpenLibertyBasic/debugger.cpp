@@ -7,6 +7,10 @@
 
 #include "debugger.hpp"
 
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
 namespace
 {
 
@@ -21,58 +25,461 @@ namespace
 
     // Total number of newlines in source.
     constexpr int64_t numSourceLines = 7;
+
+    // Buffered logpoint output is flushed once it grows beyond this size, so
+    // frequently hit logpoints produce few, large output events.
+    constexpr size_t outputFlushSize = 64 * 1024;
+
+    // Buffered logpoint output is also flushed at a loop back-edge once this
+    // much time has passed since the last flush, so slowly firing logpoints
+    // still show up while the program runs.
+    constexpr auto outputFlushInterval = std::chrono::milliseconds(100);
 }
 
-Debugger::Debugger(const EventHandler& onEvent)
+Debugger::Debugger(const EventHandler& onEvent, const OutputHandler& onOutput)
     : _onEvent(onEvent)
+    , _onOutput(onOutput)
 {
+    _thread = std::thread([this] { threadMain(); });
+}
 
+Debugger::~Debugger()
+{
+    post(Command::Terminate);
+    _thread.join();
 }
 
 void Debugger::run()
 {
+    post(Command::Continue);
+}
+
+void Debugger::pause()
+{
+    post(Command::Pause);
+}
+
+int64_t Debugger::currentLine()
+{
+    return _line.load(std::memory_order_relaxed);
+}
+
+void Debugger::stepForward()
+{
+    post(Command::Step);
+}
+
+void Debugger::stepOut()
+{
+    post(Command::StepOut);
+}
+
+void Debugger::setBreakpoints(const std::vector<Breakpoint>& breakpoints)
+{
+    std::vector<Breakpoint> sorted;
+    for (const Breakpoint& breakpoint : breakpoints)
+    {
+        if (breakpoint.line >= 1 && breakpoint.line <= numSourceLines)
+        {
+            sorted.push_back(breakpoint);
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](const Breakpoint& a, const Breakpoint& b)
+        {
+            return a.line < b.line;
+        });
+
+    std::unique_ptr<BreakpointMap> map;
+    if (!sorted.empty())
+    {
+        map = std::make_unique<BreakpointMap>();
+        map->bits.resize((numSourceLines >> 6) + 1);
+        map->entries = std::vector<BreakpointMap::Entry>(sorted.size());
+        for (size_t i = 0; i < sorted.size(); i++)
+        {
+            int64_t l = sorted[i].line;
+            map->bits[l >> 6] |= uint64_t(1) << (l & 63);
+            map->entries[i].breakpoint = std::move(sorted[i]);
+        }
+    }
+
     std::unique_lock<std::mutex> lock(_mutex);
 
-    for (int64_t i = 0; i < numSourceLines; i++)
+    // Clients re-send every breakpoint of a source when any of them changes, so
+    // carry the counters of unchanged breakpoints over from the current map.
+    // Hits counted between this copy and the swap below are lost, which only
+    // matters while the program is running and is bounded by a few lines.
+    const BreakpointMap* previous = _publishedBreakpoints.get();
+    if (map && previous)
     {
-        int64_t l = ((_line + i) % numSourceLines) + 1;
-        if (_breakpoints.count(l))
+        std::vector<bool> carried(previous->entries.size());
+        for (BreakpointMap::Entry& entry : map->entries)
         {
-            _line = l;
-            lock.unlock();
-            _onEvent(EventType::BreakpointHit);
-            return;
+            auto it = std::lower_bound(previous->entries.begin(), previous->entries.end(),
+                entry.breakpoint.line,
+                [](const BreakpointMap::Entry& e, int64_t l)
+                {
+                    return e.breakpoint.line < l;
+                });
+            for (; it != previous->entries.end() &&
+                   it->breakpoint.line == entry.breakpoint.line; ++it)
+            {
+                size_t index = it - previous->entries.begin();
+                if (!carried[index] && it->breakpoint == entry.breakpoint)
+                {
+                    carried[index] = true;
+                    entry.hits.store(it->hits.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                    break;
+                }
+            }
         }
     }
+
+    // The interpreter thread may still be reading the previous map, so it is
+    // only retired here and freed later by the interpreter thread.
+    _breakpoints.store(map.get(), std::memory_order_release);
+    if (_publishedBreakpoints)
+    {
+        _retiredBreakpoints.push_back(std::move(_publishedBreakpoints));
+        _hasRetiredBreakpoints.store(true, std::memory_order_relaxed);
+    }
+    _publishedBreakpoints = std::move(map);
 }
 
-void Debugger::pause()
+bool Debugger::BreakpointMap::test(int64_t line) const
 {
-    _onEvent(EventType::Paused);
+    size_t word = size_t(line) >> 6;
+    return word < bits.size() && (bits[word] >> (line & 63)) & 1;
 }
 
-int64_t Debugger::currentLine()
+bool Debugger::BreakpointMap::hit(int64_t line, std::string& output) const
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return _line;
+    auto it = std::lower_bound(entries.begin(), entries.end(), line,
+        [](const Entry& entry, int64_t l)
+        {
+            return entry.breakpoint.line < l;
+        });
+
+    bool stop = false;
+    for (; it != entries.end() && it->breakpoint.line == line; ++it)
+    {
+        const Breakpoint& breakpoint = it->breakpoint;
+        int64_t hits = it->hits.load(std::memory_order_relaxed) + 1;
+        it->hits.store(hits, std::memory_order_relaxed);
+        if (!breakpoint.hitCondition.matches(hits))
+        {
+            continue;
+        }
+
+        if (breakpoint.logMessage.isLogpoint())
+        {
+            breakpoint.logMessage.format(line, output);
+            output += '\n';
+        }
+        else
+        {
+            stop = true;
+        }
+    }
+    return stop;
 }
 
-void Debugger::stepForward()
+bool Debugger::HitCondition::parse(const std::string& text, HitCondition& condition)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    _line = (_line % numSourceLines) + 1;
-    lock.unlock();
-    _onEvent(EventType::Stepped);
+    const char* p = text.data();
+    const char* end = p + text.size();
+
+    auto skipSpaces = [&]
+        {
+            while (p != end && (*p == ' ' || *p == '\t'))
+            {
+                p++;
+            }
+        };
+
+    skipSpaces();
+    if (p == end)
+    {
+        condition = HitCondition();
+        return true;
+    }
+
+    static const struct
+    {
+        const char* text;
+        Op          op;
+    } ops[] =
+    {
+        // Two-character operators must come before their one-character prefixes.
+        { ">=", Op::GreaterEqual },
+        { "<=", Op::LessEqual },
+        { "==", Op::Equal },
+        { "!=", Op::NotEqual },
+        { ">", Op::Greater },
+        { "<", Op::Less },
+        { "=", Op::Equal },
+        { "%", Op::Modulo },
+    };
+
+    Op op = Op::GreaterEqual;
+    for (const auto& candidate : ops)
+    {
+        size_t length = strlen(candidate.text);
+        if (size_t(end - p) >= length && strncmp(p, candidate.text, length) == 0)
+        {
+            op = candidate.op;
+            p += length;
+            break;
+        }
+    }
+
+    skipSpaces();
+    int64_t count = 0;
+    auto result = std::from_chars(p, end, count);
+    if (result.ec != std::errc() || count < 0)
+    {
+        return false;
+    }
+    p = result.ptr;
+    skipSpaces();
+    if (p != end || (op == Op::Modulo && count == 0))
+    {
+        return false;
+    }
+
+    condition.op = op;
+    condition.count = count;
+    return true;
 }
 
-void Debugger::clearBreakpoints()
+bool Debugger::LogMessage::parse(const std::string& text, LogMessage& message,
+    std::string& error)
+{
+    message.segments.clear();
+
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t open = text.find('{', pos);
+        if (open != pos)
+        {
+            Segment segment;
+            segment.text = text.substr(pos, open - pos);
+            message.segments.push_back(segment);
+            if (open == std::string::npos)
+            {
+                break;
+            }
+        }
+
+        size_t close = text.find('}', open);
+        if (close == std::string::npos)
+        {
+            error = "Unterminated '{' in log message";
+            return false;
+        }
+
+        std::string expression = text.substr(open + 1, close - open - 1);
+        size_t first = expression.find_first_not_of(" \t");
+        size_t last = expression.find_last_not_of(" \t");
+        expression = first == std::string::npos ? "" :
+            expression.substr(first, last - first + 1);
+
+        if (expression != "currentLine")
+        {
+            error = "Unknown expression '" + expression + "' in log message";
+            return false;
+        }
+
+        Segment segment;
+        segment.kind = Segment::Kind::CurrentLine;
+        message.segments.push_back(segment);
+        pos = close + 1;
+    }
+
+    return true;
+}
+
+bool Debugger::LogMessage::isLogpoint() const
+{
+    return !segments.empty();
+}
+
+void Debugger::LogMessage::format(int64_t line, std::string& out) const
+{
+    for (const Segment& segment : segments)
+    {
+        switch (segment.kind)
+        {
+            case Segment::Kind::Text:           out += segment.text; break;
+            case Segment::Kind::CurrentLine:    out += std::to_string(line); break;
+        }
+    }
+}
+
+bool Debugger::HitCondition::matches(int64_t hits) const
+{
+    switch (op)
+    {
+        case Op::Always:        return true;
+        case Op::Equal:         return hits == count;
+        case Op::NotEqual:      return hits != count;
+        case Op::Less:          return hits < count;
+        case Op::LessEqual:     return hits <= count;
+        case Op::Greater:       return hits > count;
+        case Op::GreaterEqual:  return hits >= count;
+        case Op::Modulo:        return hits % count == 0;
+    }
+    return true;
+}
+
+void Debugger::post(Command command)
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    this->_breakpoints.clear();
+    _commands.push_back(command);
+    _interrupt.store(true, std::memory_order_release);
+    _cv.notify_all();
+}
+
+void Debugger::threadMain()
+{
+    for (;;)
+    {
+        freeRetiredBreakpoints();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]
+            {
+                return !_commands.empty();
+            });
+        Command command = _commands.front();
+        _commands.pop_front();
+        if (_commands.empty())
+        {
+            _interrupt.store(false, std::memory_order_relaxed);
+        }
+        lock.unlock();
+
+        switch (command)
+        {
+            // The synthetic program has a single frame that never returns, so
+            // stepping out runs like continue: at full speed until a breakpoint
+            // or pause stops it.
+            case Command::Continue:
+            case Command::StepOut:
+            {
+                leaveLine();
+                bool breakpointHit = execute();
+                flushOutput();
+                if (breakpointHit)
+                {
+                    _onEvent(EventType::BreakpointHit);
+                }
+                break;
+            }
+
+            case Command::Step:
+            {
+                leaveLine();
+                _line.store((_line.load(std::memory_order_relaxed) % numSourceLines) + 1,
+                    std::memory_order_relaxed);
+                flushOutput();
+                _onEvent(EventType::Stepped);
+                break;
+            }
+
+            case Command::Pause:
+            {
+                _onEvent(EventType::Paused);
+                break;
+            }
+
+            case Command::Terminate:
+            {
+                return;
+            }
+        }
+    }
 }
 
-void Debugger::addBreakpoint(int64_t l)
+void Debugger::freeRetiredBreakpoints()
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    this->_breakpoints.emplace(l);
+    _retiredBreakpoints.clear();
+    _hasRetiredBreakpoints.store(false, std::memory_order_relaxed);
+}
+
+void Debugger::leaveLine()
+{
+    if (!_lineCounted)
+    {
+        // The program is already stopped here, so a matching breakpoint does
+        // not stop it again.
+        int64_t line = _line.load(std::memory_order_relaxed);
+        const BreakpointMap* breakpoints = _breakpoints.load(std::memory_order_acquire);
+        if (breakpoints && breakpoints->test(line))
+        {
+            breakpoints->hit(line, _output);
+        }
+    }
+    _lineCounted = false;
+}
+
+void Debugger::flushOutput()
+{
+    if (!_output.empty())
+    {
+        _onOutput(_output);
+        _output.clear();
+    }
+    _lastOutputFlush = std::chrono::steady_clock::now();
+}
+
+bool Debugger::execute()
+{
+    // The synthetic program loops over its lines forever, so execution only
+    // ends at a breakpoint or when another command (pause, terminate) arrives.
+    // The interpreter thread is the only writer of _line.
+    for (;;)
+    {
+        int64_t line = (_line.load(std::memory_order_relaxed) % numSourceLines) + 1;
+        _line.store(line, std::memory_order_relaxed);
+
+        // Wrapping to the first line is the program's loop back-edge.
+        if (line == 1)
+        {
+            if (_interrupt.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+
+            if (_hasRetiredBreakpoints.load(std::memory_order_relaxed))
+            {
+                freeRetiredBreakpoints();
+            }
+
+            if (!_output.empty() &&
+                std::chrono::steady_clock::now() - _lastOutputFlush >= outputFlushInterval)
+            {
+                flushOutput();
+            }
+        }
+
+        const BreakpointMap* breakpoints = _breakpoints.load(std::memory_order_acquire);
+        if (breakpoints && breakpoints->test(line))
+        {
+            if (breakpoints->hit(line, _output))
+            {
+                _lineCounted = true;
+                return true;
+            }
+
+            if (_output.size() >= outputFlushSize)
+            {
+                flushOutput();
+            }
+        }
+    }
 }
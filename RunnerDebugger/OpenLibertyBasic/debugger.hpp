@@ -14,13 +14,22 @@
 #include "dap/protocol.h"
 #include "dap/session.h"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <unordered_set>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Debugger holds the dummy debugger state and fires events to the EventHandler
-// passed to the constructor.
+// passed to the constructor. Logpoint output is delivered to the OutputHandler.
+// The program is executed on a dedicated interpreter thread, which is driven by
+// a queue of commands. The public methods only post commands and return
+// immediately, so the DAP session thread is never blocked by execution.
 class Debugger
 {
 public:
@@ -32,8 +41,86 @@ public:
     };
 
     using EventHandler = std::function<void(EventType)>;
+    using OutputHandler = std::function<void(const std::string&)>;
 
-    Debugger(const EventHandler&);
+    // HitCondition decides whether a breakpoint stops, given the number of
+    // times it has been reached.
+    struct HitCondition
+    {
+        enum class Op
+        {
+            Always,
+            Equal,
+            NotEqual,
+            Less,
+            LessEqual,
+            Greater,
+            GreaterEqual,
+            Modulo
+        };
+
+        Op      op = Op::Always;
+        int64_t count = 0;
+
+        // parse() parses a DAP hitCondition such as "1000", ">= 1000" or "% 50".
+        // A bare number means ">=". An empty string always stops.
+        // Returns false if text is not a valid hit condition.
+        static bool parse(const std::string& text, HitCondition& condition);
+
+        // matches() returns true if the breakpoint should stop on the given hit.
+        bool matches(int64_t hits) const;
+
+        bool operator==(const HitCondition&) const = default;
+    };
+
+    // LogMessage is a logpoint message template, compiled once into segments
+    // so that formatting a hit never re-parses the text.
+    struct LogMessage
+    {
+        struct Segment
+        {
+            enum class Kind
+            {
+                Text,
+                CurrentLine
+            };
+
+            Kind        kind = Kind::Text;
+            std::string text;
+
+            bool operator==(const Segment&) const = default;
+        };
+
+        std::vector<Segment> segments;
+
+        // parse() compiles a DAP logMessage. Expressions in braces may name the
+        // debugger's variables, e.g. "reached line {currentLine}".
+        // Returns false and sets error if text is not a valid template.
+        static bool parse(const std::string& text, LogMessage& message,
+            std::string& error);
+
+        // isLogpoint() returns true if the template is non-empty, which turns
+        // its breakpoint into a logpoint.
+        bool isLogpoint() const;
+
+        // format() appends the message for a hit on line to out.
+        void format(int64_t line, std::string& out) const;
+
+        bool operator==(const LogMessage&) const = default;
+    };
+
+    // Breakpoint describes a single breakpoint passed to setBreakpoints().
+    struct Breakpoint
+    {
+        int64_t         line = 0;
+        HitCondition    hitCondition;
+        LogMessage      logMessage;
+
+        bool operator==(const Breakpoint&) const = default;
+    };
+
+    Debugger(const EventHandler&, const OutputHandler&);
+    ~Debugger();
 
     // run() instructs the debugger to continue execution.
     void run();
@@ -47,17 +134,91 @@ public:
     // stepForward() instructs the debugger to step forward one line.
     void stepForward();
 
-    // clearBreakpoints() clears all set breakpoints.
-    void clearBreakpoints();
+    // stepOut() instructs the debugger to run until the current frame returns.
+    void stepOut();
 
-    // addBreakpoint() sets a new breakpoint on the given line.
-    void addBreakpoint(int64_t line);
+    // setBreakpoints() replaces all set breakpoints. Breakpoints that are
+    // unchanged from the previous call keep their hit counts; new or edited ones
+    // start from zero. Safe to call while the program is running.
+    void setBreakpoints(const std::vector<Breakpoint>& breakpoints);
 
 private:
-    EventHandler                _onEvent;
-    std::mutex                  _mutex;
-    int64_t                     _line = 1;
-    std::unordered_set<int64_t> _breakpoints;
+    enum class Command
+    {
+        Continue,
+        Step,
+        StepOut,
+        Pause,
+        Terminate
+    };
+
+    // BreakpointMap is an immutable bitmap with one bit per source line.
+    // A new map is built for every setBreakpoints() call and published by
+    // swapping _breakpoints, so the interpreter thread reads it without locking.
+    // Each breakpoint's hit counter is stored next to it in entries, sorted by
+    // line. Counters are only incremented by the interpreter thread, and read by
+    // setBreakpoints() to carry them over into the next map.
+    struct BreakpointMap
+    {
+        struct Entry
+        {
+            Breakpoint                      breakpoint;
+            mutable std::atomic<int64_t>    hits = 0;
+        };
+
+        std::vector<uint64_t>   bits;
+        std::vector<Entry>      entries;
+
+        bool test(int64_t line) const;
+
+        // hit() counts a hit of every breakpoint on line, appends the messages
+        // of matching logpoints to output, and returns true if any of the
+        // other breakpoints should stop.
+        bool hit(int64_t line, std::string& output) const;
+    };
+
+    // post() queues a command for the interpreter thread.
+    void post(Command command);
+
+    // threadMain() is the interpreter thread loop. It executes queued commands
+    // until a Terminate command is received.
+    void threadMain();
+
+    // freeRetiredBreakpoints() frees maps replaced by setBreakpoints(). Only
+    // called by the interpreter thread while it holds no BreakpointMap: between
+    // commands and at loop back-edges.
+    void freeRetiredBreakpoints();
+
+    // leaveLine() is called before the program moves off the line it is
+    // stopped on. Unless that stop was a breakpoint hit, which already counted
+    // it, the line is counted and its logpoints emitted here.
+    void leaveLine();
+
+    // flushOutput() sends buffered logpoint output to the OutputHandler.
+    void flushOutput();
+
+    // execute() runs the program until a breakpoint is hit or another command is
+    // posted. Returns true if a breakpoint was hit.
+    // Pending commands are noticed through _interrupt, which is only polled at
+    // loop back-edges, instead of inspecting the command queue on every line.
+    // Breakpoints cost one bit test per line and no locking.
+    bool execute();
+
+    EventHandler                        _onEvent;
+    OutputHandler                       _onOutput;
+    std::mutex                          _mutex;
+    std::condition_variable             _cv;
+    std::deque<Command>                 _commands;
+    std::atomic<bool>                   _interrupt = false;
+    std::atomic<int64_t>                _line = 1;
+    std::atomic<const BreakpointMap*>   _breakpoints = nullptr;
+    std::unique_ptr<const BreakpointMap> _publishedBreakpoints;
+    std::vector<std::unique_ptr<const BreakpointMap>> _retiredBreakpoints;
+    std::atomic<bool>                   _hasRetiredBreakpoints = false;
+    std::string                         _output;
+    std::chrono::steady_clock::time_point _lastOutputFlush;
+    bool                                _lineCounted = false;
+    std::thread                         _thread;
 };
 
 
@@ -111,8 +111,19 @@ int main(int, char*[])
             }
         };
 
+    // Output handler from the Debugger. Logpoint messages arrive here in
+    // batches and are forwarded to the client's debug console.
+    auto onDebuggerOutput =
+        [&](const std::string& output)
+        {
+            dap::OutputEvent event;
+            event.category = "console";
+            event.output = output;
+            session->send(event);
+        };
+
     // Construct the debugger.
-    Debugger debugger(onDebuggerEvent);
+    Debugger debugger(onDebuggerEvent, onDebuggerOutput);
 
     // Handle errors reported by the Session. These errors include protocol
     // parsing errors and receiving messages with no handler.
@@ -135,6 +146,8 @@ int main(int, char*[])
         {
             dap::InitializeResponse response;
             response.supportsConfigurationDoneRequest = true;
+            response.supportsHitConditionalBreakpoints = true;
+            response.supportsLogPoints = true;
             return response;
         });
 
@@ -250,6 +263,8 @@ int main(int, char*[])
 
     // The Continue request instructs the debugger to resume execution of one or
     // all threads.
+    // Execution happens on the debugger's interpreter thread, so this returns
+    // immediately and the session stays responsive while the program runs.
     // https://microsoft.github.io/debug-adapter-protocol/specification#Requests_Continue
     session->registerHandler(
         [&](const dap::ContinueRequest&)
@@ -284,7 +299,7 @@ int main(int, char*[])
     session->registerHandler(
         [&](const dap::StepOutRequest&)
         {
-            // Step-out is not supported as there's only one stack frame.
+            debugger.stepOut();
             return dap::StepOutResponse();
         });
 
@@ -300,13 +315,35 @@ int main(int, char*[])
             auto breakpoints = request.breakpoints.value({});
             if (request.source.sourceReference.value(0) == sourceReferenceId)
             {
-                debugger.clearBreakpoints();
+                std::vector<Debugger::Breakpoint> debuggerBreakpoints;
                 response.breakpoints.resize(breakpoints.size());
                 for (size_t i = 0; i < breakpoints.size(); i++)
                 {
-                    debugger.addBreakpoint(breakpoints[i].line);
+                    Debugger::Breakpoint breakpoint;
+                    breakpoint.line = breakpoints[i].line;
+
+                    auto hitCondition = breakpoints[i].hitCondition.value("");
+                    if (!Debugger::HitCondition::parse(hitCondition, breakpoint.hitCondition))
+                    {
+                        response.breakpoints[i].verified = false;
+                        response.breakpoints[i].message =
+                            "Invalid hit condition '" + hitCondition + "'";
+                        continue;
+                    }
+
+                    std::string error;
+                    if (!Debugger::LogMessage::parse(breakpoints[i].logMessage.value(""),
+                            breakpoint.logMessage, error))
+                    {
+                        response.breakpoints[i].verified = false;
+                        response.breakpoints[i].message = error;
+                        continue;
+                    }
+
+                    debuggerBreakpoints.push_back(breakpoint);
                     response.breakpoints[i].verified = breakpoints[i].line < numSourceLines;
                 }
+                debugger.setBreakpoints(debuggerBreakpoints);
             }
             else
             {